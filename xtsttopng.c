@@ -16,6 +16,9 @@
  */
 
 #define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -23,7 +26,22 @@
 #include <string.h>
 #include <libgen.h>
 #include <math.h>
+#include <getopt.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <png.h>
+#include <zlib.h>
+
+#define ARRAY_SIZE(a)	((int) (sizeof (a) / sizeof ((a)[0])))
 
 /*
  * Unique pixel values mapped to RGB values for all
@@ -43,6 +61,56 @@ struct xts_color {
 struct xts_color    *colors[MAX_LEVEL];
 int                 num_colors;
 
+#ifdef COLOR_STATS
+/*
+ * Skip list counters for --stats. Lookups also happen on the
+ * archival worker threads, hence the atomic updates.
+ */
+struct color_stats {
+	uint64_t	levels[MAX_LEVEL + 1];
+	uint64_t	lookups, hits, inserts;
+	uint64_t	visited, max_visited;
+	uint64_t	bytes;
+};
+
+static struct color_stats color_stats;
+
+#define COLOR_STAT_ADD(field, n) \
+	__atomic_fetch_add(&color_stats.field, (n), __ATOMIC_RELAXED)
+
+static void
+color_stat_visited(uint64_t visited)
+{
+	uint64_t max = __atomic_load_n(&color_stats.max_visited, __ATOMIC_RELAXED);
+
+	COLOR_STAT_ADD(visited, visited);
+	while (visited > max &&
+	       !__atomic_compare_exchange_n(&color_stats.max_visited, &max, visited,
+					    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void
+print_color_stats(void)
+{
+	int i;
+
+	fprintf(stderr, "color lookups: %" PRIu64 ", %" PRIu64 " hits, %" PRIu64
+		" inserts\n", color_stats.lookups, color_stats.hits,
+		color_stats.inserts);
+	fprintf(stderr, "nodes visited per lookup: %.2f average, %" PRIu64 " max\n",
+		color_stats.lookups ?
+		(double) color_stats.visited / color_stats.lookups : 0.0,
+		color_stats.max_visited);
+	fprintf(stderr, "color node memory: %" PRIu64 " bytes\n", color_stats.bytes);
+	fprintf(stderr, "color node levels:");
+	for (i = 1; i <= MAX_LEVEL; i++)
+		if (color_stats.levels[i])
+			fprintf(stderr, " %d:%" PRIu64, i, color_stats.levels[i]);
+	fprintf(stderr, "\n");
+}
+#endif
+
 static uint16_t
 random_level (void)
 {
@@ -67,6 +135,11 @@ alloc_color (void) {
 	if (!c)
 		return NULL;
 	c->level = level;
+#ifdef COLOR_STATS
+	COLOR_STAT_ADD(levels[level], 1);
+	COLOR_STAT_ADD(bytes, sizeof (struct xts_color) +
+		       level * sizeof (struct xts_color *));
+#endif
 	return c;
 }
 
@@ -135,11 +208,24 @@ assign_hsv(struct xts_color *color, float h, float s, float v)
 	color->b = b;
 }
 
+/*
+ * Images are kept in the run-length form found in the XTS
+ * file; pixels are only expanded a row at a time when needed
+ */
+struct xts_run {
+	uint32_t		length;
+	uint32_t		pixel;
+};
+
 struct xts_image {
 	struct xts_image	*next;
+	struct xts_image	*good;		/* image to diff against */
 	char			*dest_file;
+	char			*diff_file;
+	char			*dzi_file;
 	int			width, height, depth;
-	uint32_t		pixels[];
+	int			num_runs, size_runs;
+	struct xts_run		runs[];
 };
 
 static void
@@ -170,6 +256,11 @@ find_color(struct xts_image *image, uint32_t pixel) {
 	struct xts_color    **update[MAX_LEVEL];
 	struct xts_color    *s, **next;
 	int i;
+#ifdef COLOR_STATS
+	uint64_t visited = 0;
+
+	COLOR_STAT_ADD(lookups, 1);
+#endif
 
 	/* Find the specified pixel value, saving the
 	 * trace in case we need to insert
@@ -177,13 +268,25 @@ find_color(struct xts_image *image, uint32_t pixel) {
 	next = colors;
 	for (i = MAX_LEVEL; --i >= 0;) {
 		for (; (s = next[i]); next = s->next) {
-			if (s->pixel == pixel)
+#ifdef COLOR_STATS
+			visited++;
+#endif
+			if (s->pixel == pixel) {
+#ifdef COLOR_STATS
+				COLOR_STAT_ADD(hits, 1);
+				color_stat_visited(visited);
+#endif
 				return s;
+			}
 			if (s->pixel > pixel)
 				break;
 		}
 		update[i] = &next[i];
 	}
+#ifdef COLOR_STATS
+	COLOR_STAT_ADD(inserts, 1);
+	color_stat_visited(visited);
+#endif
 
 	/* Insert a new color structure into the skiplist
 	 */
@@ -202,9 +305,47 @@ static void
 free_image(struct xts_image *image)
 {
 	free (image->dest_file);
+	free (image->diff_file);
+	free (image->dzi_file);
 	free (image);
 }
 
+/*
+ * Append a run to the image, merging it with the previous one
+ * when the pixel values match. Returns the (possibly moved)
+ * image or NULL on allocation failure.
+ */
+static struct xts_image *
+add_run(struct xts_image *image, uint32_t length, uint32_t pixel)
+{
+	struct xts_run *last;
+
+	if (image->num_runs) {
+		last = &image->runs[image->num_runs - 1];
+		if (last->pixel == pixel) {
+			last->length += length;
+			return image;
+		}
+	}
+	if (image->num_runs == image->size_runs) {
+		struct xts_image *new;
+		int size = image->size_runs * 2;
+
+		new = realloc(image, sizeof (struct xts_image) +
+			      size * sizeof (struct xts_run));
+		if (!new) {
+			free(image);
+			return NULL;
+		}
+		image = new;
+		image->size_runs = size;
+	}
+	image->runs[image->num_runs].length = length;
+	image->runs[image->num_runs].pixel = pixel;
+	image->num_runs++;
+	return image;
+}
+
 /*
  * Read one XTS image into memory from the specified file
  */
@@ -216,7 +357,6 @@ read_image(FILE *file, char *inname)
 	int count;
 	int run;
 	uint32_t pixel;
-	uint32_t *pixels;
 	char line[80];
 
 	if (fscanf(file, "%d %d %d\n", &width, &height, &depth) != 3) {
@@ -225,16 +365,16 @@ read_image(FILE *file, char *inname)
 		return NULL;
 	}
 
-	image = malloc (sizeof (struct xts_image) +
-			(width * height * sizeof (uint32_t)));
+	image = calloc (1, sizeof (struct xts_image) +
+			16 * sizeof (struct xts_run));
 	if (!image)
 		return NULL;
     
 	count = width * height;
-	pixels = image->pixels;
 	image->width = width;
 	image->height = height;
 	image->depth = depth;
+	image->size_runs = 16;
 	while (count > 0) {
 		if (fgets(line, sizeof(line), file) == NULL) {
 			fprintf (stderr, "%s: read error\n", inname);
@@ -251,21 +391,64 @@ read_image(FILE *file, char *inname)
 			run = 1;
 		}
 		find_color(image, pixel);
-		while (run > 0 && count > 0) {
-			*pixels++ = pixel;
-			run--;
-			count--;
-		}
-		if (run) {
+		if (run < 0 || run > count) {
 			fprintf (stderr, "%s: run left over at end\n",
 				 inname);
 			free(image);
 			return NULL;
 		}
+		if (run == 0)
+			continue;
+		image = add_run(image, run, pixel);
+		if (!image)
+			return NULL;
+		count -= run;
 	}
 	return image;
 }
 
+/*
+ * Walk the runs of an image in order, expanding
+ * them into RGB values one row at a time
+ */
+struct xts_run_iter {
+	const struct xts_run	*run, *end;
+	uint32_t		left;
+};
+
+static void
+run_iter_init(struct xts_run_iter *iter, const struct xts_image *image)
+{
+	iter->run = image->runs;
+	iter->end = image->runs + image->num_runs;
+	iter->left = image->num_runs ? image->runs[0].length : 0;
+}
+
+static uint32_t
+color_rgb(const struct xts_color *color)
+{
+	return (color->b << 16) | (color->g << 8) | color->r;
+}
+
+static void
+run_iter_row(struct xts_run_iter *iter, struct xts_image *image, uint32_t *row)
+{
+	int x = 0;
+
+	while (x < image->width) {
+		uint32_t rgb = color_rgb(find_color(image, iter->run->pixel));
+		uint32_t n = iter->left;
+
+		if (n > (uint32_t) (image->width - x))
+			n = image->width - x;
+		iter->left -= n;
+		while (n--)
+			row[x++] = rgb;
+		if (iter->left == 0 && ++iter->run < iter->end)
+			iter->left = iter->run->length;
+	}
+}
+
 static void
 png_simple_output_flush_fn (png_structp png_ptr)
 {
@@ -287,127 +470,2261 @@ stdio_write_func (png_structp png, png_bytep data, png_size_t size)
 	}
 }
 
-static void
-dump_png(FILE *file, struct xts_image *image)
+/*
+ * Each PNG carries the pixel values used in the image and the
+ * colors they were drawn with, so the original values can be
+ * recovered without the XTS file. The private chunk holds
+ * 7-byte entries sorted by pixel value: the pixel as a 32-bit
+ * big-endian number followed by red, green and blue.
+ */
+#define COLOR_MAP_CHUNK		"xtPm"
+#define COLOR_MAP_ENTRY		7
+
+static int
+compare_pixel(const void *a, const void *b)
 {
-	png_struct *png;
-	png_info *info;
-	png_byte **rows = NULL;
-	int status;
-	uint32_t *rgb, *r;
-	uint32_t *pixels, pixel;
-	int i;
-	int count;
+	uint32_t pa = *(const uint32_t *) a, pb = *(const uint32_t *) b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static png_byte *
+color_map(struct xts_image *image, size_t *size)
+{
+	uint32_t *pixels;
+	png_byte *map, *m;
 	struct xts_color *color;
+	int i, n = 0;
 
-	/* Convert from pixel values to RGB image
-	 */
-	rgb = malloc (image->height * image->width * sizeof (uint32_t));
-	if (!rgb)
-		return;
-    
-	r = rgb;
-	pixels = image->pixels;
-	count = image->width * image->height;
-	while (count-- > 0)  {
-		pixel = *pixels++;
-		color = find_color(image, pixel);
-		*r++ = (color->b << 16) | (color->g << 8) | color->r;
+	pixels = malloc(image->num_runs * sizeof (uint32_t));
+	if (!pixels)
+		return NULL;
+	for (i = 0; i < image->num_runs; i++)
+		pixels[i] = image->runs[i].pixel;
+	qsort(pixels, image->num_runs, sizeof (uint32_t), compare_pixel);
+	for (i = 0; i < image->num_runs; i++)
+		if (n == 0 || pixels[n - 1] != pixels[i])
+			pixels[n++] = pixels[i];
+
+	map = m = malloc(n * COLOR_MAP_ENTRY);
+	if (map) {
+		for (i = 0; i < n; i++) {
+			color = find_color(image, pixels[i]);
+			png_save_uint_32(m, pixels[i]);
+			m[4] = color->r;
+			m[5] = color->g;
+			m[6] = color->b;
+			m += COLOR_MAP_ENTRY;
+		}
+		*size = n * COLOR_MAP_ENTRY;
 	}
+	free (pixels);
+	return map;
+}
 
-	/* Allocate PNG structures as needed and initialize
-	 */
-	rows = calloc(image->height, sizeof (png_byte *));
-	if (!rows)
-		return;
+static void
+set_color_map(png_struct *png, png_info *info, png_byte *map, size_t size)
+{
+	png_unknown_chunk chunk;
+
+	memcpy(chunk.name, COLOR_MAP_CHUNK, sizeof (chunk.name));
+	chunk.data = map;
+	chunk.size = size;
+	chunk.location = PNG_HAVE_IHDR;
+	png_set_unknown_chunks (png, info, &chunk, 1);
+}
 
-	for (i = 0; i < image->height; i++)
-		rows[i] = (png_byte *) rgb + i * image->width * sizeof (uint32_t);
+/*
+ * Create a PNG writer for a width x height RGB image. Rows are
+ * handed to png_write_row as 32-bit RGBx values.
+ */
+static png_struct *
+start_png(png_voidp io, png_rw_ptr write_fn, int width, int height,
+	  png_byte *map, size_t map_size, png_info **infop)
+{
+	png_struct *png;
+	png_info *info;
+	int status;
 
 	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, &status,
 				      NULL, NULL);
 	if (!png)
-		return;
+		return NULL;
 
 	info = png_create_info_struct(png);
-	if (!info)
-		return;
+	if (!info) {
+		png_destroy_write_struct (&png, NULL);
+		return NULL;
+	}
 
-	png_set_write_fn (png, file, stdio_write_func, png_simple_output_flush_fn);
+	png_set_write_fn (png, io, write_fn, png_simple_output_flush_fn);
 
 	png_set_IHDR (png, info,
-		      image->width,
-		      image->height,
+		      width,
+		      height,
 		      8,
 		      PNG_COLOR_TYPE_RGB,
 		      PNG_INTERLACE_NONE,
 		      PNG_COMPRESSION_TYPE_DEFAULT,
 		      PNG_FILTER_TYPE_DEFAULT);
 
+	if (map)
+		set_color_map(png, info, map, map_size);
 	png_write_info(png, info);
 	png_set_filler (png, 0, PNG_FILLER_AFTER);
-	png_write_image (png, rows);
+	*infop = info;
+	return png;
+}
+
+static void
+finish_png(png_struct *png, png_info *info)
+{
 	png_write_end (png, info);
 	png_destroy_write_struct (&png, &info);
-	free (rows);
-	free (rgb);
 }
 
-/* Create a new filename from the original filename with the specified
- * index and extension
+static void
+write_png(png_voidp io, png_rw_ptr write_fn, struct xts_image *image)
+{
+	png_struct *png;
+	png_info *info;
+	uint32_t *row;
+	png_byte *map;
+	size_t map_size = 0;
+	struct xts_run_iter iter;
+	int y;
+
+	/* Convert from pixel values to RGB a row at a time
+	 */
+	row = malloc (image->width * sizeof (uint32_t));
+	if (!row)
+		return;
+
+	map = color_map(image, &map_size);
+	png = start_png(io, write_fn, image->width, image->height,
+			map, map_size, &info);
+	free (map);
+	if (!png) {
+		free (row);
+		return;
+	}
+
+	run_iter_init(&iter, image);
+	for (y = 0; y < image->height; y++) {
+		run_iter_row(&iter, image, row);
+		png_write_row (png, (png_byte *) row);
+	}
+	finish_png(png, info);
+	free (row);
+}
+
+static void
+dump_png(FILE *file, struct xts_image *image)
+{
+	write_png(file, stdio_write_func, image);
+}
+
+/*
+ * Differences between a bad/good image pair, computed directly
+ * from the run-length data. Spans are offsets into the image
+ * in raster order, sorted and non-adjacent.
  */
-static char *
-newname(char *orig_name, int i, const char *extension)
+struct xts_span {
+	uint32_t		offset;
+	uint32_t		length;
+};
+
+struct xts_diff {
+	uint32_t		mismatched;
+	int			x1, y1, x2, y2;	/* bounding box, inclusive */
+	int			num_spans, size_spans;
+	struct xts_span		*spans;
+};
+
+static bool
+add_span(struct xts_diff *diff, uint32_t offset, uint32_t length)
 {
-	char        *b = basename(orig_name);
-	char        *dot = strrchr(b, '.');
-	char        *new;
-	if (!dot)
-		dot = b + strlen(b);
-	*dot = '\0';
+	struct xts_span *last;
 
-	if (!asprintf(&new, "%s-%d.%s", b, i, extension))
-		new = NULL;
-	return new;
+	if (diff->num_spans) {
+		last = &diff->spans[diff->num_spans - 1];
+		if (last->offset + last->length == offset) {
+			last->length += length;
+			return true;
+		}
+	}
+	if (diff->num_spans == diff->size_spans) {
+		int size = diff->size_spans ? diff->size_spans * 2 : 16;
+		struct xts_span *new = realloc(diff->spans,
+					       size * sizeof (struct xts_span));
+		if (!new)
+			return false;
+		diff->spans = new;
+		diff->size_spans = size;
+	}
+	diff->spans[diff->num_spans].offset = offset;
+	diff->spans[diff->num_spans].length = length;
+	diff->num_spans++;
+	return true;
 }
 
-int
-main (int argc, char **argv)
+/*
+ * Merge-join the run lists of two equally sized images,
+ * recording each stretch where the pixel values differ
+ */
+static bool
+diff_images(struct xts_image *bad, struct xts_image *good,
+	    struct xts_diff *diff)
 {
-	struct xts_image *image;
-	FILE        *input;
-	FILE        *output;
-	char        *inname;
-	int         f, i;
-	struct xts_image	*images = NULL, **last = &images;
+	const struct xts_run *a = bad->runs, *b = good->runs;
+	const struct xts_run *a_end = a + bad->num_runs;
+	const struct xts_run *b_end = b + good->num_runs;
+	uint32_t a_left, b_left, n, offset = 0;
+	int i;
 
-	/* Read all of the images
-	 */
-	for (f = 1; f < argc; f++) {
-		inname = argv[f];
-		input = fopen(inname, "r");
-		if (!input) {
-			perror(inname);
+	memset(diff, 0, sizeof (*diff));
+	diff->x1 = bad->width;
+	diff->y1 = bad->height;
+	diff->x2 = diff->y2 = -1;
+
+	a_left = a < a_end ? a->length : 0;
+	b_left = b < b_end ? b->length : 0;
+	while (a < a_end && b < b_end) {
+		n = a_left < b_left ? a_left : b_left;
+		if (a->pixel != b->pixel) {
+			if (!add_span(diff, offset, n))
+				return false;
+			diff->mismatched += n;
+		}
+		offset += n;
+		if ((a_left -= n) == 0 && ++a < a_end)
+			a_left = a->length;
+		if ((b_left -= n) == 0 && ++b < b_end)
+			b_left = b->length;
+	}
+
+	for (i = 0; i < diff->num_spans; i++) {
+		uint32_t first = diff->spans[i].offset;
+		uint32_t last = first + diff->spans[i].length - 1;
+		int y1 = first / bad->width, y2 = last / bad->width;
+		int x1 = first % bad->width, x2 = last % bad->width;
+
+		if (y1 != y2) {
+			x1 = 0;
+			x2 = bad->width - 1;
+		}
+		if (x1 < diff->x1) diff->x1 = x1;
+		if (y1 < diff->y1) diff->y1 = y1;
+		if (x2 > diff->x2) diff->x2 = x2;
+		if (y2 > diff->y2) diff->y2 = y2;
+	}
+	return true;
+}
+
+/*
+ * Write a mask of the differing pixels. Rows without any
+ * differences all share a single black row.
+ */
+#define DIFF_SAME	0x000000
+#define DIFF_CHANGED	0xffffff
+
+static void
+dump_diff_png(FILE *file, struct xts_image *image, struct xts_diff *diff)
+{
+	png_struct *png;
+	png_info *info;
+	uint32_t *same, *row;
+	int y, x, i = 0;
+
+	same = calloc (image->width, sizeof (uint32_t));
+	row = malloc (image->width * sizeof (uint32_t));
+	if (!same || !row)
+		goto bail;
+
+	png = start_png(file, stdio_write_func, image->width, image->height,
+			NULL, 0, &info);
+	if (!png)
+		goto bail;
+
+	for (y = 0; y < image->height; y++) {
+		uint32_t row_start = (uint32_t) y * image->width;
+		uint32_t row_end = row_start + image->width;
+
+		if (i == diff->num_spans || diff->spans[i].offset >= row_end) {
+			png_write_row (png, (png_byte *) same);
 			continue;
 		}
-		i = 0;
-		while ((image = read_image(input, inname)) != NULL) {
-			image->dest_file = newname(inname, i++, "png");
-			image->next = NULL;
-			*last = image;
-			last = &image->next;
+		for (x = 0; x < image->width; x++)
+			row[x] = DIFF_SAME;
+		for (; i < diff->num_spans; i++) {
+			struct xts_span *span = &diff->spans[i];
+			uint32_t start = span->offset, end = start + span->length;
+
+			if (start >= row_end)
+				break;
+			if (start < row_start)
+				start = row_start;
+			if (end > row_end)
+				end = row_end;
+			for (; start < end; start++)
+				row[start - row_start] = DIFF_CHANGED;
+			if (span->offset + span->length > row_end)
+				break;
 		}
+		png_write_row (png, (png_byte *) row);
 	}
+	finish_png(png, info);
+bail:
+	free (row);
+	free (same);
+}
 
-	/* Assign colors for the whole set
+static void
+report_diff(struct xts_image *bad, struct xts_image *good)
+{
+	struct xts_diff diff;
+	FILE *output;
+
+	if (bad->width != good->width || bad->height != good->height) {
+		printf ("%s %s: size mismatch %dx%d %dx%d\n",
+			bad->dest_file, good->dest_file,
+			bad->width, bad->height, good->width, good->height);
+		return;
+	}
+	if (!diff_images(bad, good, &diff)) {
+		fprintf (stderr, "%s: out of memory\n", bad->diff_file);
+		free (diff.spans);
+		return;
+	}
+	if (diff.mismatched == 0)
+		printf ("%s %s: identical\n", bad->dest_file, good->dest_file);
+	else
+		printf ("%s %s: %u pixels differ in %d spans within %dx%d+%d+%d\n",
+			bad->dest_file, good->dest_file,
+			diff.mismatched, diff.num_spans,
+			diff.x2 - diff.x1 + 1, diff.y2 - diff.y1 + 1,
+			diff.x1, diff.y1);
+
+	if (bad->diff_file && diff.mismatched) {
+		printf ("%s\n", bad->diff_file);
+		output = fopen(bad->diff_file, "w");
+		if (!output)
+			perror(bad->diff_file);
+		else {
+			dump_diff_png(output, bad, &diff);
+			fclose(output);
+		}
+	}
+	free (diff.spans);
+}
+
+/*
+ * Deep Zoom tile pyramid. The rows of the image are pushed
+ * through a chain of levels, each half the size of the one
+ * above; a level writes out a row of tiles whenever it has
+ * gathered tile_size rows and passes every pair of rows on,
+ * averaged, to the next smaller level. Only one band of rows
+ * per level is ever held in memory.
+ */
+struct pyramid_level {
+	int			width, height;
+	int			y;		/* rows received */
+	uint32_t		*band;		/* tile_size rows */
+	uint32_t		*pending;	/* even row awaiting its pair */
+	bool			have_pending;
+};
+
+struct pyramid {
+	char			*dir;
+	int			tile_size;
+	int			num_levels;
+	struct pyramid_level	*levels;
+	uint32_t		*half;		/* reduced row, see pyramid_row */
+	bool			failed;
+};
+
+static void
+pyramid_tiles(struct pyramid *p, int l)
+{
+	struct pyramid_level *level = &p->levels[l];
+	int rows = (level->y - 1) % p->tile_size + 1;
+	int row = (level->y - 1) / p->tile_size;
+	int col, r, width;
+	char *name;
+	FILE *file;
+	png_struct *png;
+	png_info *info;
+
+	for (col = 0; col * p->tile_size < level->width; col++) {
+		width = level->width - col * p->tile_size;
+		if (width > p->tile_size)
+			width = p->tile_size;
+		if (asprintf(&name, "%s/%d/%d_%d.png", p->dir, l, col, row) < 0) {
+			fprintf (stderr, "%s: out of memory\n", p->dir);
+			p->failed = true;
+			return;
+		}
+		file = fopen(name, "w");
+		if (!file) {
+			perror(name);
+			p->failed = true;
+			free (name);
+			return;
+		}
+		png = start_png(file, stdio_write_func, width, rows,
+				NULL, 0, &info);
+		if (!png) {
+			fprintf (stderr, "%s: out of memory\n", name);
+			p->failed = true;
+			fclose(file);
+			free (name);
+			return;
+		}
+		for (r = 0; r < rows; r++)
+			png_write_row (png, (png_byte *)
+				       (level->band + r * level->width +
+					col * p->tile_size));
+		finish_png(png, info);
+		fclose(file);
+		free (name);
+	}
+}
+
+static uint32_t
+average4(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	uint32_t rb, g;
+
+	rb = ((a & 0xff00ff) + (b & 0xff00ff) + (c & 0xff00ff) +
+	      (d & 0xff00ff) + 0x020002) >> 2;
+	g = ((a & 0xff00) + (b & 0xff00) + (c & 0xff00) +
+	     (d & 0xff00) + 0x200) >> 2;
+	return (rb & 0xff00ff) | (g & 0xff00);
+}
+
+static void
+pyramid_row(struct pyramid *p, int l, const uint32_t *row)
+{
+	struct pyramid_level *level = &p->levels[l];
+	const uint32_t *above;
+	int x, x2;
+
+	memcpy(level->band + (level->y % p->tile_size) * level->width,
+	       row, level->width * sizeof (uint32_t));
+	level->y++;
+	if (level->y % p->tile_size == 0 || level->y == level->height)
+		pyramid_tiles(p, l);
+
+	if (l == 0)
+		return;
+
+	/* An odd last row is paired with itself */
+	if (!level->have_pending && level->y < level->height) {
+		memcpy(level->pending, row, level->width * sizeof (uint32_t));
+		level->have_pending = true;
+		return;
+	}
+	/* When 'row' is p->half itself, reducing in place is safe
+	 * as half[x] only depends on row[2x] and row[2x + 1]
 	 */
-	assign_rgb();
+	above = level->have_pending ? level->pending : row;
+	level->have_pending = false;
+	for (x = 0; x < p->levels[l - 1].width; x++) {
+		x2 = 2 * x + 1 < level->width ? 2 * x + 1 : 2 * x;
+		p->half[x] = average4(above[2 * x], above[x2],
+				      row[2 * x], row[x2]);
+	}
+	pyramid_row(p, l - 1, p->half);
+}
 
-	/* Write all of the images out using the
-	 * allocated colors
+static void
+free_pyramid(struct pyramid *p)
+{
+	int l;
+
+	for (l = 0; p->levels && l < p->num_levels; l++) {
+		free (p->levels[l].band);
+		free (p->levels[l].pending);
+	}
+	free (p->levels);
+	free (p->half);
+	free (p->dir);
+}
+
+#define DEFAULT_TILE_SIZE	256
+
+static void
+dump_pyramid(const char *dzi_file, struct xts_image *image, int tile_size)
+{
+	struct pyramid p = { .tile_size = tile_size };
+	struct xts_run_iter iter;
+	uint32_t *row = NULL;
+	int l, y, width, height;
+	char *dir;
+	FILE *dzi;
+
+	/* Level 0 is a single pixel, the last is full size */
+	for (p.num_levels = 1;
+	     (1 << (p.num_levels - 1)) < image->width ||
+		     (1 << (p.num_levels - 1)) < image->height;
+	     p.num_levels++)
+		;
+
+	if (asprintf(&p.dir, "%.*s_files", (int) (strrchr(dzi_file, '.') - dzi_file),
+		     dzi_file) < 0) {
+		fprintf (stderr, "%s: out of memory\n", dzi_file);
+		p.dir = NULL;
+		return;
+	}
+	p.levels = calloc(p.num_levels, sizeof (struct pyramid_level));
+	p.half = malloc(((image->width + 1) / 2 + 1) * sizeof (uint32_t));
+	row = malloc(image->width * sizeof (uint32_t));
+	if (!p.levels || !p.half || !row)
+		goto oom;
+
+	if (mkdir(p.dir, 0777) < 0 && errno != EEXIST) {
+		perror(p.dir);
+		goto bail;
+	}
+	width = image->width;
+	height = image->height;
+	for (l = p.num_levels; --l >= 0;) {
+		struct pyramid_level *level = &p.levels[l];
+
+		level->width = width;
+		level->height = height;
+		level->band = malloc((size_t) (tile_size < height ? tile_size : height) *
+				     width * sizeof (uint32_t));
+		level->pending = malloc(width * sizeof (uint32_t));
+		if (!level->band || !level->pending)
+			goto oom;
+		if (asprintf(&dir, "%s/%d", p.dir, l) < 0)
+			goto oom;
+		if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+			perror(dir);
+			free (dir);
+			goto bail;
+		}
+		free (dir);
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	run_iter_init(&iter, image);
+	for (y = 0; y < image->height && !p.failed; y++) {
+		run_iter_row(&iter, image, row);
+		pyramid_row(&p, p.num_levels - 1, row);
+	}
+
+	/* Without every tile, a descriptor would only lead viewers
+	 * to missing files; drop any left from an earlier run too
+	 */
+	if (p.failed) {
+		fprintf (stderr, "%s: tiles incomplete, not written\n", dzi_file);
+		unlink(dzi_file);
+		goto bail;
+	}
+
+	dzi = fopen(dzi_file, "w");
+	if (!dzi) {
+		perror(dzi_file);
+		goto bail;
+	}
+	fprintf(dzi,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+		"       Format=\"png\" Overlap=\"0\" TileSize=\"%d\">\n"
+		"  <Size Width=\"%d\" Height=\"%d\"/>\n"
+		"</Image>\n",
+		tile_size, image->width, image->height);
+	fclose(dzi);
+	goto bail;
+oom:
+	fprintf (stderr, "%s: out of memory\n", dzi_file);
+bail:
+	free (row);
+	free_pyramid(&p);
+}
+
+/*
+ * CPU and memory actually available to this process. Inside a
+ * container the processor count and physical memory overstate
+ * this, so any cgroup (v1 or v2) limits are applied as well.
+ */
+struct resources {
+	int			online;		/* processors online */
+	int			affinity;	/* processors we may run on */
+	double			quota;		/* cgroup CPU quota, 0 if none */
+	int			cpus;		/* default worker count */
+	uint64_t		physical;
+	uint64_t		cgroup_memory;	/* 0 if none */
+	uint64_t		budget;		/* for decoded images */
+};
+
+static struct resources resources;
+
+/* First value in a cgroup file; "max" and missing files read as unlimited */
+static bool
+read_cgroup_value(const char *dir, const char *name, int64_t *value,
+		  int64_t *second)
+{
+	char *path, word[32];
+	FILE *file;
+	int n;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return false;
+	file = fopen(path, "r");
+	free (path);
+	if (!file)
+		return false;
+	n = fscanf(file, "%31s %" SCNd64, word, second);
+	fclose(file);
+	if (n < 1 || !strcmp(word, "max"))
+		return false;
+	*value = strtoll(word, NULL, 10);
+	return *value >= 0;
+}
+
+/*
+ * Apply the limits found in one cgroup directory and each of
+ * its parents up to the mount point. When the path is not
+ * visible inside a container this still reaches the mount
+ * root, which is then the container's own group.
+ */
+static void
+cgroup_scan(const char *root, const char *cgroup, double *quota,
+	    uint64_t *memory)
+{
+	char *dir, *slash;
+	int64_t value, period;
+	size_t root_len = strlen(root);
+
+	if (asprintf(&dir, "%s%s", root, cgroup) < 0)
+		return;
+	for (;;) {
+		period = 0;
+		if (read_cgroup_value(dir, "cpu.max", &value, &period) ||
+		    (read_cgroup_value(dir, "cpu.cfs_quota_us", &value, &period) &&
+		     read_cgroup_value(dir, "cpu.cfs_period_us", &period, &period))) {
+			if (value > 0 && period > 0 &&
+			    (*quota == 0 || (double) value / period < *quota))
+				*quota = (double) value / period;
+		}
+		if (read_cgroup_value(dir, "memory.max", &value, &period) ||
+		    read_cgroup_value(dir, "memory.limit_in_bytes", &value, &period)) {
+			if (value > 0 && (*memory == 0 || (uint64_t) value < *memory))
+				*memory = value;
+		}
+		slash = strrchr(dir, '/');
+		if (!slash || (size_t) (slash - dir) < root_len)
+			break;
+		*slash = '\0';
+	}
+	free (dir);
+}
+
+static void
+cgroup_limits(double *quota, uint64_t *memory)
+{
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	char line[4096], *controllers, *cgroup, *root;
+	const char *path;
+
+	if (!file)
+		return;
+	while (fgets(line, sizeof (line), file)) {
+		line[strcspn(line, "\n")] = '\0';
+		controllers = strchr(line, ':');
+		if (!controllers)
+			continue;
+		cgroup = strchr(++controllers, ':');
+		if (!cgroup)
+			continue;
+		*cgroup++ = '\0';
+		path = strcmp(cgroup, "/") ? cgroup : "";
+
+		if (*controllers == '\0') {
+			/* v2, either alone or beside v1 hierarchies */
+			if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0)
+				cgroup_scan("/sys/fs/cgroup", path, quota, memory);
+			else
+				cgroup_scan("/sys/fs/cgroup/unified", path,
+					    quota, memory);
+		} else if (strstr(controllers, "cpu") ||
+			   strstr(controllers, "memory")) {
+			if (asprintf(&root, "/sys/fs/cgroup/%s", controllers) < 0)
+				continue;
+			cgroup_scan(root, path, quota, memory);
+			free (root);
+		}
+	}
+	fclose(file);
+}
+
+static void
+resources_init(void)
+{
+	cpu_set_t set;
+	uint64_t limit;
+
+	resources.online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (resources.online < 1)
+		resources.online = 1;
+	resources.affinity = resources.online;
+	if (sched_getaffinity(0, sizeof (set), &set) == 0 && CPU_COUNT(&set) > 0)
+		resources.affinity = CPU_COUNT(&set);
+	resources.physical = (uint64_t) sysconf(_SC_PHYS_PAGES) *
+		sysconf(_SC_PAGESIZE);
+
+	cgroup_limits(&resources.quota, &resources.cgroup_memory);
+
+	/* cgroup v1 reports "unlimited" as a huge number */
+	if (resources.cgroup_memory >= resources.physical)
+		resources.cgroup_memory = 0;
+
+	resources.cpus = resources.affinity;
+	if (resources.quota > 0 && ceil(resources.quota) < resources.cpus)
+		resources.cpus = ceil(resources.quota);
+
+	/* Leave half of the memory for the run-length images, the
+	 * color table and everything else in the process
+	 */
+	limit = resources.physical;
+	if (resources.cgroup_memory && resources.cgroup_memory < limit)
+		limit = resources.cgroup_memory;
+	resources.budget = limit / 2;
+}
+
+#define MiB(x)	((x) >> 20)
+
+static void
+print_resources(int workers)
+{
+	fprintf(stderr, "processors: %d online, %d usable", resources.online,
+		resources.affinity);
+	if (resources.quota > 0)
+		fprintf(stderr, ", cgroup quota %.2f", resources.quota);
+	fprintf(stderr, "\ndefault workers: %d", resources.cpus);
+	fprintf(stderr, "\nmemory: %" PRIu64 " MiB physical", MiB(resources.physical));
+	if (resources.cgroup_memory)
+		fprintf(stderr, ", cgroup limit %" PRIu64 " MiB",
+			MiB(resources.cgroup_memory));
+	fprintf(stderr, "\nimage memory budget: %" PRIu64 " MiB\n",
+		MiB(resources.budget));
+	if (workers)
+		fprintf(stderr, "threads: %d\n", workers);
+}
+
+/*
+ * GNU make jobserver client. When run from a parallel make, each
+ * worker thread beyond the first must hold a token read from the
+ * jobserver while it runs a job, so the whole build stays within
+ * the -j limit given to make.
+ */
+struct jobserver {
+	bool			active;
+	bool			serial;		/* under make without tokens */
+	int			read_fd, write_fd;
+};
+
+static struct jobserver jobserver;
+
+static bool
+jobserver_fd_valid(int fd)
+{
+	return fd >= 0 && fcntl(fd, F_GETFD) >= 0;
+}
+
+static void
+jobserver_init(void)
+{
+	const char *flags = getenv("MAKEFLAGS");
+	const char *auth = NULL, *p;
+	char *fifo;
+	size_t len;
+	int fd;
+
+	if (!flags)
+		return;
+
+	/* The last setting wins, as with make itself */
+	for (p = flags; (p = strstr(p, "--jobserver-")) != NULL; p++) {
+		if (!strncmp(p, "--jobserver-auth=", 17))
+			auth = p + 17;
+		else if (!strncmp(p, "--jobserver-fds=", 16))
+			auth = p + 16;
+	}
+	if (!auth)
+		return;
+
+	len = strcspn(auth, " \t");
+	if (!strncmp(auth, "fifo:", 5)) {
+		fifo = strndup(auth + 5, len - 5);
+		fd = fifo ? open(fifo, O_RDWR | O_NONBLOCK) : -1;
+		free (fifo);
+		jobserver.read_fd = jobserver.write_fd = fd;
+	} else if (sscanf(auth, "%d,%d", &jobserver.read_fd,
+			  &jobserver.write_fd) != 2)
+		jobserver.read_fd = jobserver.write_fd = -1;
+
+	if (jobserver_fd_valid(jobserver.read_fd) &&
+	    jobserver_fd_valid(jobserver.write_fd)) {
+		jobserver.active = true;
+	} else
+		jobserver.serial = true;
+}
+
+/*
+ * Wait for a token, or for 'wake' to be closed once there is no
+ * work left. A pipe shared with make may be in blocking mode, in
+ * which case another client can take the token between poll and
+ * read; that only delays the wakeup until a token comes back.
+ */
+static int
+jobserver_acquire(int wake)
+{
+	struct pollfd fds[2] = {
+		{ .fd = jobserver.read_fd, .events = POLLIN },
+		{ .fd = wake, .events = POLLIN },
+	};
+	unsigned char token;
+	ssize_t n;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (fds[1].revents)
+			return -1;
+		n = read(jobserver.read_fd, &token, 1);
+		if (n == 1)
+			return token;
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		return -1;
+	}
+}
+
+static void
+jobserver_release(int token)
+{
+	unsigned char c = token;
+
+	while (write(jobserver.write_fd, &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Run 'count' jobs across 'workers' threads, the calling
+ * thread included
+ */
+struct job_pool {
+	pthread_mutex_t		lock;
+	int			next, count;
+	int			running, peak;	/* jobs in progress */
+	int			wake[2];
+	void			(*init)(void);	/* run on each worker thread */
+	void			(*run)(void *closure, int job);
+	void			*closure;
+};
+
+static int
+next_job(struct job_pool *pool)
+{
+	int job;
+
+	pthread_mutex_lock(&pool->lock);
+	job = pool->next < pool->count ? pool->next++ : -1;
+	if (job >= 0 && ++pool->running > pool->peak)
+		pool->peak = pool->running;
+	pthread_mutex_unlock(&pool->lock);
+	return job;
+}
+
+static void
+end_job(struct job_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->running--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *
+pool_worker(void *arg)
+{
+	struct job_pool *pool = arg;
+	int job;
+
+	if (pool->init)
+		pool->init();
+	while ((job = next_job(pool)) >= 0) {
+		pool->run(pool->closure, job);
+		end_job(pool);
+	}
+	return NULL;
+}
+
+/* Extra workers run one job per jobserver token */
+static void *
+pool_token_worker(void *arg)
+{
+	struct job_pool *pool = arg;
+	int job, token;
+
+	if (pool->init)
+		pool->init();
+	while ((token = jobserver_acquire(pool->wake[0])) >= 0) {
+		job = next_job(pool);
+		if (job >= 0) {
+			pool->run(pool->closure, job);
+			end_job(pool);
+		}
+		jobserver_release(token);
+		if (job < 0)
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * The jobs all run on new threads, leaving the calling thread
+ * untouched by 'init'. If even the first thread cannot be
+ * started, the caller runs the jobs itself without 'init'.
+ * Returns the number of threads; under a jobserver fewer jobs
+ * may have run at once, which is reported in 'peak'.
+ */
+static int
+run_jobs(int workers, int count, void (*init)(void),
+	 void (*run)(void *closure, int job), void *closure, int *peak)
+{
+	struct job_pool pool = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.count = count,
+		.init = init,
+		.run = run,
+		.closure = closure,
+	};
+	void *(*worker)(void *) = pool_worker;
+	pthread_t *threads;
+	int started = 0;
+
+	if (workers > count)
+		workers = count;
+	if (workers < 1)
+		workers = 1;
+	if (jobserver.serial && workers > 1) {
+		fprintf(stderr, "jobserver unavailable, running serially; "
+			"mark the recipe with '+' to share make's job slots\n");
+		workers = 1;
+	}
+	if (jobserver.active && workers > 1) {
+		if (pipe(pool.wake) < 0)
+			workers = 1;
+		else
+			worker = pool_token_worker;
+	}
+
+	/* The first thread holds the token make gave this process */
+	threads = calloc(workers, sizeof (pthread_t));
+	if (threads && pthread_create(&threads[0], NULL, pool_worker, &pool) == 0) {
+		started = 1;
+		while (started < workers &&
+		       pthread_create(&threads[started], NULL,
+				      worker, &pool) == 0)
+			started++;
+		pthread_join(threads[0], NULL);
+	} else {
+		pool.init = NULL;
+		pool_worker(&pool);
+	}
+	if (worker == pool_token_worker)
+		close(pool.wake[1]);
+	workers = started ? started : 1;
+	while (started > 1)
+		pthread_join(threads[--started], NULL);
+	if (worker == pool_token_worker)
+		close(pool.wake[0]);
+	free (threads);
+	*peak = pool.peak;
+	return workers;
+}
+
+/*
+ * Archival encoding. Every combination of pixel format, row
+ * filter and deflate strategy is tried at maximum compression,
+ * the smallest result is decoded again and checked against the
+ * source pixels before it is written.
+ */
+struct png_buf {
+	png_byte		*data;
+	size_t			size, alloc;
+	bool			failed;		/* data was dropped */
+};
+
+/*
+ * Running out of memory only marks the buffer as failed, as
+ * write_png has no jmpbuf for png_error to return to
+ */
+static void
+buf_write_func (png_structp png, png_bytep data, png_size_t size)
+{
+	struct png_buf *buf = png_get_io_ptr (png);
+
+	if (buf->failed)
+		return;
+	if (buf->size + size > buf->alloc) {
+		size_t alloc = buf->alloc ? buf->alloc : 4096;
+		png_byte *new;
+
+		while (alloc < buf->size + size)
+			alloc *= 2;
+		new = realloc(buf->data, alloc);
+		if (!new) {
+			buf->failed = true;
+			return;
+		}
+		buf->data = new;
+		buf->alloc = alloc;
+	}
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+struct png_read_buf {
+	const png_byte		*data;
+	size_t			size, pos;
+};
+
+static void
+buf_read_func (png_structp png, png_bytep data, png_size_t size)
+{
+	struct png_read_buf *buf = png_get_io_ptr (png);
+
+	if (size > buf->size - buf->pos)
+		png_error(png, "truncated");
+	memcpy(data, buf->data + buf->pos, size);
+	buf->pos += size;
+}
+
+/* Source pixels, packed as (b << 16) | (g << 8) | r */
+struct archive_image {
+	int			width, height;
+	uint32_t		*rgb;
+	png_byte		*map;		/* COLOR_MAP_CHUNK contents */
+	size_t			map_size;
+	png_unknown_chunk	*chunks;	/* other ancillary chunks */
+	int			num_chunks;
+};
+
+static void
+fini_archive_image(struct archive_image *img)
+{
+	int i;
+
+	for (i = 0; i < img->num_chunks; i++)
+		free (img->chunks[i].data);
+	free (img->chunks);
+	free (img->map);
+	free (img->rgb);
+	img->chunks = NULL;
+	img->num_chunks = 0;
+	img->map = NULL;
+	img->rgb = NULL;
+}
+
+#define RGB_R(c)	((c) & 0xff)
+#define RGB_G(c)	(((c) >> 8) & 0xff)
+#define RGB_B(c)	(((c) >> 16) & 0xff)
+
+#define PALETTE_HASH	1024
+
+struct archive_palette {
+	int			num;
+	uint32_t		color[256];
+	uint32_t		count[256];
+	uint8_t			remap[256];
+	uint16_t		hash[PALETTE_HASH];	/* index + 1 */
+};
+
+static int
+palette_slot(struct archive_palette *pal, uint32_t c)
+{
+	int h = (c * 2654435761u) >> 22;
+
+	while (pal->hash[h] && pal->color[pal->hash[h] - 1] != c)
+		h = (h + 1) & (PALETTE_HASH - 1);
+	return h;
+}
+
+static bool
+build_palette(struct archive_image *img, struct archive_palette *pal)
+{
+	size_t i, count = (size_t) img->width * img->height;
+
+	memset(pal, 0, sizeof (*pal));
+	for (i = 0; i < count; i++) {
+		uint32_t c = img->rgb[i];
+		int h = palette_slot(pal, c);
+
+		if (!pal->hash[h]) {
+			if (pal->num == 256)
+				return false;
+			pal->color[pal->num] = c;
+			pal->hash[h] = ++pal->num;
+		}
+		pal->count[pal->hash[h] - 1]++;
+	}
+	return true;
+}
+
+/* Set up remap[] to order the palette by first appearance
+ * or by decreasing frequency
+ */
+static void
+order_palette(struct archive_palette *pal, bool by_count)
+{
+	uint8_t order[256], t;
+	int i, j;
+
+	for (i = 0; i < pal->num; i++) {
+		order[i] = i;
+		for (j = i; by_count && j > 0 &&
+			     pal->count[order[j - 1]] < pal->count[order[j]]; j--) {
+			t = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = t;
+		}
+	}
+	for (i = 0; i < pal->num; i++)
+		pal->remap[order[i]] = i;
+}
+
+/* Smallest gray bit depth holding every pixel exactly, or 0 */
+static int
+gray_depth(struct archive_image *img)
+{
+	size_t i, count = (size_t) img->width * img->height;
+	int depth = 1;
+
+	for (i = 0; i < count; i++) {
+		uint32_t c = img->rgb[i];
+
+		if (RGB_R(c) != RGB_G(c) || RGB_R(c) != RGB_B(c))
+			return 0;
+		while (depth < 8 && RGB_R(c) % (255 / ((1 << depth) - 1)))
+			depth <<= 1;
+	}
+	return depth;
+}
+
+enum archive_format { FORMAT_RGB, FORMAT_GRAY, FORMAT_PALETTE };
+
+struct archive_encoding {
+	enum archive_format	format;
+	int			depth;
+	int			filter;
+	int			strategy;
+};
+
+static void
+pack_row(struct archive_image *img, struct archive_palette *pal,
+	 const struct archive_encoding *enc, int y, png_byte *row)
+{
+	const uint32_t *src = img->rgb + (size_t) y * img->width;
+	int x, shift = 8, sample;
+
+	if (enc->format == FORMAT_RGB) {
+		for (x = 0; x < img->width; x++) {
+			*row++ = RGB_R(src[x]);
+			*row++ = RGB_G(src[x]);
+			*row++ = RGB_B(src[x]);
+		}
+		return;
+	}
+	memset(row, 0, (img->width * enc->depth + 7) / 8);
+	for (x = 0; x < img->width; x++) {
+		if (enc->format == FORMAT_GRAY)
+			sample = RGB_R(src[x]) / (255 / ((1 << enc->depth) - 1));
+		else
+			sample = pal->remap[pal->hash[palette_slot(pal, src[x])] - 1];
+		shift -= enc->depth;
+		*row |= sample << shift;
+		if (shift == 0) {
+			row++;
+			shift = 8;
+		}
+	}
+}
+
+static bool
+encode_png(struct archive_image *img, struct archive_palette *pal,
+	   const struct archive_encoding *enc, struct png_buf *buf)
+{
+	png_struct *png;
+	png_info *info;
+	png_byte *row;
+	int y, i;
+	int color_type[] = {
+		[FORMAT_RGB] = PNG_COLOR_TYPE_RGB,
+		[FORMAT_GRAY] = PNG_COLOR_TYPE_GRAY,
+		[FORMAT_PALETTE] = PNG_COLOR_TYPE_PALETTE,
+	};
+
+	buf->size = 0;
+	buf->failed = false;
+	row = malloc(img->width * 3 + 1);
+	if (!row)
+		return false;
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png) {
+		free (row);
+		return false;
+	}
+	info = png_create_info_struct(png);
+	if (!info || setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct (&png, &info);
+		free (row);
+		return false;
+	}
+
+	png_set_write_fn (png, buf, buf_write_func, png_simple_output_flush_fn);
+	png_set_compression_level (png, Z_BEST_COMPRESSION);
+	png_set_compression_mem_level (png, MAX_MEM_LEVEL);
+	png_set_compression_strategy (png, enc->strategy);
+	png_set_filter (png, PNG_FILTER_TYPE_BASE, enc->filter);
+
+	png_set_IHDR (png, info,
+		      img->width,
+		      img->height,
+		      enc->depth,
+		      color_type[enc->format],
+		      PNG_INTERLACE_NONE,
+		      PNG_COMPRESSION_TYPE_DEFAULT,
+		      PNG_FILTER_TYPE_DEFAULT);
+
+	if (enc->format == FORMAT_PALETTE) {
+		png_color plte[256];
+
+		for (i = 0; i < pal->num; i++) {
+			plte[pal->remap[i]].red = RGB_R(pal->color[i]);
+			plte[pal->remap[i]].green = RGB_G(pal->color[i]);
+			plte[pal->remap[i]].blue = RGB_B(pal->color[i]);
+		}
+		png_set_PLTE (png, info, plte, pal->num);
+	}
+	if (img->map)
+		set_color_map(png, info, img->map, img->map_size);
+	if (img->num_chunks) {
+		png_set_keep_unknown_chunks (png, PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
+		png_set_unknown_chunks (png, info, img->chunks, img->num_chunks);
+	}
+
+	png_write_info(png, info);
+	for (y = 0; y < img->height; y++) {
+		pack_row(img, pal, enc, y, row);
+		png_write_row (png, row);
+	}
+	png_write_end (png, info);
+	png_destroy_write_struct (&png, &info);
+	free (row);
+	return !buf->failed;
+}
+
+/* Copy out the color map chunk, if the PNG has one */
+static void
+get_color_map(png_struct *png, png_info *info, png_byte **map, size_t *size)
+{
+	png_unknown_chunkp chunks;
+	int i, n;
+
+	n = png_get_unknown_chunks (png, info, &chunks);
+	for (i = 0; i < n; i++) {
+		if (memcmp(chunks[i].name, COLOR_MAP_CHUNK, 4) != 0)
+			continue;
+		*map = malloc(chunks[i].size);
+		if (!*map)
+			png_error(png, "out of memory");
+		memcpy(*map, chunks[i].data, chunks[i].size);
+		*size = chunks[i].size;
+		break;
+	}
+}
+
+/*
+ * Ancillary chunks that libpng would otherwise consume. Those
+ * describing the colors or the image as a whole carry over to
+ * the new encoding unchanged; bKGD, hIST and sBIT are tied to
+ * the pixel format, which archival encoding may change.
+ */
+static const char keep_chunks[] =
+	"cHRM\0eXIf\0gAMA\0iCCP\0iTXt\0oFFs\0pCAL\0pHYs\0"
+	"sCAL\0sPLT\0sRGB\0tEXt\0tIME\0zTXt\0"
+	"bKGD\0hIST\0sBIT\0";
+#define NUM_COPY_CHUNKS	14
+#define NUM_KEEP_CHUNKS	17
+
+static bool
+copy_chunk(const png_byte *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_COPY_CHUNKS; i++)
+		if (!memcmp(name, keep_chunks + i * 5, 4))
+			return true;
+
+	/* Unknown chunks only when they are safe to copy, which
+	 * also turns away APNG animation chunks
+	 */
+	for (; i < NUM_KEEP_CHUNKS; i++)
+		if (!memcmp(name, keep_chunks + i * 5, 4))
+			return false;
+	return (name[3] & 0x20) != 0;
+}
+
+/*
+ * Collect every ancillary chunk, refusing the image when one
+ * of them could not be carried over
+ */
+static void
+get_chunks(png_struct *png, png_info *info, struct archive_image *img)
+{
+	png_unknown_chunkp chunks;
+	png_unknown_chunk *c;
+	char message[64];
+	int i, n;
+
+	n = png_get_unknown_chunks (png, info, &chunks);
+	img->chunks = calloc(n ? n : 1, sizeof (png_unknown_chunk));
+	if (!img->chunks)
+		png_error(png, "out of memory");
+	for (i = 0; i < n; i++) {
+		if (!memcmp(chunks[i].name, COLOR_MAP_CHUNK, 4))
+			continue;
+		if (!copy_chunk(chunks[i].name)) {
+			snprintf(message, sizeof (message),
+				 "%.4s chunk cannot be preserved", chunks[i].name);
+			png_error(png, message);
+		}
+		c = &img->chunks[img->num_chunks];
+		*c = chunks[i];
+		c->data = malloc(c->size ? c->size : 1);
+		if (!c->data)
+			png_error(png, "out of memory");
+		memcpy(c->data, chunks[i].data, c->size);
+		img->num_chunks++;
+	}
+}
+
+#define DECODE_ERROR_SIZE	128
+
+static void
+decode_error(png_structp png, png_const_charp message)
+{
+	snprintf(png_get_error_ptr(png), DECODE_ERROR_SIZE, "%s", message);
+	png_longjmp(png, 1);
+}
+
+/*
+ * Decode a PNG into 8-bit RGB. Only images without alpha
+ * or 16-bit samples are accepted, as converting those would
+ * change the pixels. Returns false with the reason in 'why'.
+ */
+static bool
+decode_png(const png_byte *data, size_t size, struct archive_image *img,
+	   char *why)
+{
+	struct png_read_buf buf = { .data = data, .size = size };
+	png_struct *png;
+	png_info *info;
+	png_byte ** volatile rows = NULL;
+	png_uint_32 width, height;
+	int depth, color_type, y;
+	size_t i, count;
+
+	memset(img, 0, sizeof (*img));
+	snprintf(why, DECODE_ERROR_SIZE, "out of memory");
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, why,
+				     decode_error, NULL);
+	if (!png)
+		return false;
+	info = png_create_info_struct(png);
+	if (!info || setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct (&png, &info, NULL);
+		free (rows);
+		fini_archive_image(img);
+		return false;
+	}
+
+	png_set_read_fn (png, &buf, buf_read_func);
+	png_set_keep_unknown_chunks (png, PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
+	png_set_keep_unknown_chunks (png, PNG_HANDLE_CHUNK_ALWAYS,
+				     (png_const_bytep) keep_chunks, NUM_KEEP_CHUNKS);
+	png_read_info (png, info);
+	png_get_IHDR (png, info, &width, &height, &depth, &color_type,
+		      NULL, NULL, NULL);
+	if (depth > 8 || (color_type & PNG_COLOR_MASK_ALPHA) ||
+	    png_get_valid (png, info, PNG_INFO_tRNS) ||
+	    width > INT_MAX / 4 || height > INT_MAX / width)
+		png_error(png, "not an 8-bit opaque PNG");
+
+	/* Interlaced images need every pass read into the
+	 * whole image, so decode straight into img->rgb as RGBx
+	 * bytes and repack them afterwards
+	 */
+	png_set_expand (png);
+	png_set_gray_to_rgb (png);
+	png_set_filler (png, 0, PNG_FILLER_AFTER);
+	png_set_interlace_handling (png);
+	png_read_update_info (png, info);
+
+	img->width = width;
+	img->height = height;
+	count = (size_t) width * height;
+	img->rgb = malloc(count * sizeof (uint32_t));
+	rows = malloc(height * sizeof (png_byte *));
+	if (!img->rgb || !rows)
+		png_error(png, "out of memory");
+	for (y = 0; y < img->height; y++)
+		rows[y] = (png_byte *) (img->rgb + (size_t) y * width);
+	png_read_image (png, rows);
+	for (i = 0; i < count; i++) {
+		png_byte *b = (png_byte *) &img->rgb[i];
+
+		img->rgb[i] = (b[2] << 16) | (b[1] << 8) | b[0];
+	}
+	png_read_end (png, info);
+	get_color_map(png, info, &img->map, &img->map_size);
+	get_chunks(png, info, img);
+	png_destroy_read_struct (&png, &info, NULL);
+	free (rows);
+	return true;
+}
+
+static bool
+verify_png(struct png_buf *buf, struct archive_image *img)
+{
+	struct archive_image check;
+	char why[DECODE_ERROR_SIZE];
+	bool ok;
+	int i;
+
+	if (!decode_png(buf->data, buf->size, &check, why))
+		return false;
+	ok = check.width == img->width && check.height == img->height &&
+		memcmp(check.rgb, img->rgb,
+		       (size_t) img->width * img->height * sizeof (uint32_t)) == 0 &&
+		(check.map ? img->map && check.map_size == img->map_size &&
+		 memcmp(check.map, img->map, img->map_size) == 0 : !img->map) &&
+		check.num_chunks == img->num_chunks;
+	for (i = 0; ok && i < img->num_chunks; i++)
+		ok = !memcmp(check.chunks[i].name, img->chunks[i].name, 4) &&
+			check.chunks[i].size == img->chunks[i].size &&
+			!memcmp(check.chunks[i].data, img->chunks[i].data,
+				img->chunks[i].size);
+	fini_archive_image(&check);
+	return ok;
+}
+
+/* Leaves the smallest encoding in 'best' */
+static bool
+archive_encode(struct archive_image *img, struct png_buf *best)
+{
+	static const int filters[] = {
+		PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+		PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS,
+	};
+	static const int strategies[] = {
+		Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE,
+	};
+	struct archive_palette pal;
+	struct archive_encoding enc;
+	struct png_buf buf = { 0 }, tmp;
+	bool have_palette;
+	int pass, f, s;
+
+	best->size = 0;
+	have_palette = build_palette(img, &pal);
+	for (pass = 0; pass < 4; pass++) {
+		switch (pass) {
+		case 0:
+			enc.format = FORMAT_RGB;
+			enc.depth = 8;
+			break;
+		case 1:
+			enc.format = FORMAT_GRAY;
+			enc.depth = gray_depth(img);
+			if (!enc.depth)
+				continue;
+			break;
+		case 2:
+		case 3:
+			if (!have_palette)
+				continue;
+			enc.format = FORMAT_PALETTE;
+			enc.depth = pal.num <= 2 ? 1 : pal.num <= 4 ? 2 :
+				pal.num <= 16 ? 4 : 8;
+			order_palette(&pal, pass == 3);
+			break;
+		}
+		for (f = 0; f < ARRAY_SIZE(filters); f++) {
+			enc.filter = filters[f];
+			for (s = 0; s < ARRAY_SIZE(strategies); s++) {
+				enc.strategy = strategies[s];
+				if (!encode_png(img, &pal, &enc, &buf))
+					continue;
+				if (best->size == 0 || buf.size < best->size) {
+					tmp = *best;
+					*best = buf;
+					buf = tmp;
+				}
+			}
+		}
+	}
+	free (buf.data);
+	return best->size && verify_png(best, img);
+}
+
+struct archive_job {
+	char			*name;
+	struct xts_image	*image;		/* NULL when re-encoding a PNG */
+	uint64_t		pixels;
+};
+
+struct archive_state {
+	struct archive_job	*jobs;
+	pthread_mutex_t		lock;
+	int			files;
+	uint64_t		before, after;
+};
+
+static bool
+read_file(const char *name, struct png_buf *buf)
+{
+	FILE *file = fopen(name, "r");
+	png_byte data[65536];
+	size_t n;
+
+	if (!file)
+		return false;
+	buf->size = 0;
+	while ((n = fread(data, 1, sizeof (data), file)) > 0) {
+		png_byte *new = realloc(buf->data, buf->size + n);
+		if (!new)
+			break;
+		buf->data = new;
+		memcpy(buf->data + buf->size, data, n);
+		buf->size += n;
+	}
+	n = ferror(file) || !feof(file);
+	fclose(file);
+	return !n;
+}
+
+/* Write through a temporary file so an interrupted run never
+ * leaves a truncated output behind
+ */
+static bool
+write_file(const char *name, struct png_buf *buf)
+{
+	char *tmp;
+	FILE *file;
+	bool ok;
+
+	if (asprintf(&tmp, "%s.tmp", name) < 0)
+		return false;
+	file = fopen(tmp, "w");
+	if (!file) {
+		free (tmp);
+		return false;
+	}
+	ok = fwrite(buf->data, 1, buf->size, file) == buf->size;
+	ok = fclose(file) == 0 && ok;
+	if (ok)
+		ok = rename(tmp, name) == 0;
+	if (!ok)
+		unlink(tmp);
+	free (tmp);
+	return ok;
+}
+
+static void
+archive_one(void *closure, int i)
+{
+	struct archive_state *state = closure;
+	struct archive_job *job = &state->jobs[i];
+	struct archive_image img = { 0 };
+	struct png_buf orig = { 0 }, best = { 0 };
+	char why[DECODE_ERROR_SIZE];
+	size_t before;
+
+	if (job->image) {
+		struct xts_run_iter iter;
+		int y;
+
+		img.width = job->image->width;
+		img.height = job->image->height;
+		img.rgb = malloc((size_t) img.width * img.height * sizeof (uint32_t));
+		if (!img.rgb) {
+			fprintf (stderr, "%s: out of memory\n", job->name);
+			return;
+		}
+		run_iter_init(&iter, job->image);
+		for (y = 0; y < img.height; y++)
+			run_iter_row(&iter, job->image,
+				     img.rgb + (size_t) y * img.width);
+
+		img.map = color_map(job->image, &img.map_size);
+
+		/* Measure against what dump_png would have written */
+		write_png(&orig, buf_write_func, job->image);
+		if (orig.failed) {
+			fprintf (stderr, "%s: out of memory\n", job->name);
+			goto done;
+		}
+	} else {
+		if (!read_file(job->name, &orig)) {
+			perror(job->name);
+			return;
+		}
+		if (!decode_png(orig.data, orig.size, &img, why)) {
+			fprintf (stderr, "%s: %s, skipped\n", job->name, why);
+			free (orig.data);
+			return;
+		}
+	}
+	before = orig.size;
+
+	if (!archive_encode(&img, &best)) {
+		fprintf (stderr, "%s: archival encoding failed verification\n",
+			 job->name);
+		goto done;
+	}
+
+	/* Existing files are only replaced when they shrink */
+	if (!job->image && best.size >= before) {
+		free (best.data);
+		best = orig;
+		orig.data = NULL;
+	} else if (!write_file(job->name, &best)) {
+		perror(job->name);
+		goto done;
+	}
+
+	printf ("%s: %zu -> %zu bytes\n", job->name, before, best.size);
+	pthread_mutex_lock(&state->lock);
+	state->files++;
+	state->before += before;
+	state->after += best.size;
+	pthread_mutex_unlock(&state->lock);
+done:
+	free (best.data);
+	free (orig.data);
+	fini_archive_image(&img);
+}
+
+/*
+ * Archival runs should only use otherwise idle CPU and disk time.
+ * Linux keeps both priorities per thread, so only the archive
+ * workers are affected; elsewhere the nice value applies to the
+ * whole process.
+ */
+static void
+archive_priority(void)
+{
+#ifdef __linux__
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19) < 0)
+#else
+	if (setpriority(PRIO_PROCESS, 0, 19) < 0)
+#endif
+		perror("setpriority");
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	{
+		const int who_process = 1, class_idle = 3, class_shift = 13;
+
+		if (syscall(SYS_ioprio_set, who_process, 0,
+			    class_idle << class_shift) < 0)
+			perror("ioprio_set");
+	}
+#endif
+}
+
+/*
+ * Each job holds the source pixels, a decoded copy for
+ * verification and the candidate encodings at once
+ */
+#define ARCHIVE_BYTES_PER_PIXEL	(3 * sizeof (uint32_t))
+
+static int
+archive(struct archive_job *jobs, int count, int workers, int *peak)
+{
+	struct archive_state state = {
+		.jobs = jobs,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	uint64_t largest = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (jobs[i].pixels > largest)
+			largest = jobs[i].pixels;
+	if (largest && resources.budget / (largest * ARCHIVE_BYTES_PER_PIXEL) <
+	    (uint64_t) workers) {
+		workers = resources.budget / (largest * ARCHIVE_BYTES_PER_PIXEL);
+		if (workers < 1)
+			workers = 1;
+	}
+
+	workers = run_jobs(workers, count, archive_priority, archive_one, &state,
+			   peak);
+	if (state.files)
+		printf ("%d files: %" PRIu64 " -> %" PRIu64 " bytes, %.1f%% saved\n",
+			state.files, state.before, state.after,
+			state.before ?
+			100.0 * (state.before - state.after) / state.before : 0.0);
+	return workers;
+}
+
+/* Create a new filename from the original filename with the specified
+ * index and extension
+ */
+static char *
+newname(char *orig_name, int i, const char *extension)
+{
+	char        *copy = strdup(orig_name);
+	char        *b, *dot;
+	char        *new;
+
+	if (!copy)
+		return NULL;
+	b = basename(copy);
+	dot = strrchr(b, '.');
+	if (!dot)
+		dot = b + strlen(b);
+	*dot = '\0';
+
+	if (asprintf(&new, "%s-%d.%s", b, i, extension) < 0)
+		new = NULL;
+	free (copy);
+	return new;
+}
+
+/*
+ * Inverted index from pixel values to the images using them.
+ * All numbers are 32-bit big-endian:
+ *
+ *	"XTSINDEX" version files pixels entries
+ *	files × (length, name)
+ *	pixels × (pixel, first entry, entry count), sorted by pixel
+ *	entries × (file, image, pixel count)
+ */
+#define INDEX_MAGIC	"XTSINDEX"
+#define INDEX_VERSION	1
+
+struct index_entry {
+	uint32_t		pixel;
+	uint32_t		file, image;
+	uint32_t		count;
+};
+
+struct xts_index {
+	int			num_files, size_files;
+	char			**files;
+	int			num_entries, size_entries;
+	struct index_entry	*entries;
+};
+
+static int
+compare_entry(const void *a, const void *b)
+{
+	const struct index_entry *ea = a, *eb = b;
+
+	if (ea->pixel != eb->pixel)
+		return ea->pixel < eb->pixel ? -1 : 1;
+	if (ea->file != eb->file)
+		return ea->file < eb->file ? -1 : 1;
+	return ea->image < eb->image ? -1 : ea->image > eb->image;
+}
+
+static bool
+index_add_file(struct xts_index *index, char *name)
+{
+	if (index->num_files == index->size_files) {
+		int size = index->size_files ? index->size_files * 2 : 16;
+		char **new = realloc(index->files, size * sizeof (char *));
+
+		if (!new)
+			return false;
+		index->files = new;
+		index->size_files = size;
+	}
+	index->files[index->num_files++] = name;
+	return true;
+}
+
+/* Add an entry for each pixel value in the image of the last file */
+static bool
+index_add_image(struct xts_index *index, struct xts_image *image, int i)
+{
+	struct index_entry *e;
+	int r, first = index->num_entries, n;
+
+	if (index->num_entries + image->num_runs > index->size_entries) {
+		int size = index->size_entries ? index->size_entries : 1024;
+		struct index_entry *new;
+
+		while (size < index->num_entries + image->num_runs)
+			size *= 2;
+		new = realloc(index->entries, size * sizeof (*new));
+		if (!new)
+			return false;
+		index->entries = new;
+		index->size_entries = size;
+	}
+	e = index->entries + first;
+	for (r = 0; r < image->num_runs; r++) {
+		e[r].pixel = image->runs[r].pixel;
+		e[r].file = index->num_files - 1;
+		e[r].image = i;
+		e[r].count = image->runs[r].length;
+	}
+	qsort(e, image->num_runs, sizeof (*e), compare_entry);
+	for (r = 0, n = 0; r < image->num_runs; r++) {
+		if (n && e[n - 1].pixel == e[r].pixel)
+			e[n - 1].count += e[r].count;
+		else
+			e[n++] = e[r];
+	}
+	index->num_entries += n;
+	return true;
+}
+
+static bool
+put_uint32(FILE *file, uint32_t value)
+{
+	png_byte buf[4];
+
+	png_save_uint_32(buf, value);
+	return fwrite(buf, 1, 4, file) == 4;
+}
+
+static bool
+get_uint32(FILE *file, uint32_t *value)
+{
+	png_byte buf[4];
+
+	if (fread(buf, 1, 4, file) != 4)
+		return false;
+	*value = png_get_uint_32(buf);
+	return true;
+}
+
+static bool
+write_index(struct xts_index *index, const char *name)
+{
+	FILE *file;
+	uint32_t num_pixels = 0;
+	int i, first;
+	bool ok;
+
+	qsort(index->entries, index->num_entries, sizeof (struct index_entry),
+	      compare_entry);
+	for (i = 0; i < index->num_entries; i++)
+		if (i == 0 || index->entries[i].pixel != index->entries[i - 1].pixel)
+			num_pixels++;
+
+	file = fopen(name, "w");
+	if (!file)
+		return false;
+	ok = fwrite(INDEX_MAGIC, 1, 8, file) == 8 &&
+		put_uint32(file, INDEX_VERSION) &&
+		put_uint32(file, index->num_files) &&
+		put_uint32(file, num_pixels) &&
+		put_uint32(file, index->num_entries);
+	for (i = 0; ok && i < index->num_files; i++) {
+		size_t len = strlen(index->files[i]);
+
+		ok = put_uint32(file, len) &&
+			fwrite(index->files[i], 1, len, file) == len;
+	}
+	for (i = 0, first = 0; ok && i <= index->num_entries; i++) {
+		if (i > first && (i == index->num_entries ||
+				  index->entries[i].pixel != index->entries[first].pixel)) {
+			ok = put_uint32(file, index->entries[first].pixel) &&
+				put_uint32(file, first) &&
+				put_uint32(file, i - first);
+			first = i;
+		}
+	}
+	for (i = 0; ok && i < index->num_entries; i++)
+		ok = put_uint32(file, index->entries[i].file) &&
+			put_uint32(file, index->entries[i].image) &&
+			put_uint32(file, index->entries[i].count);
+	ok = fclose(file) == 0 && ok;
+	return ok;
+}
+
+/*
+ * Look up pixel values in an index written by --index, using
+ * a binary search of the pixel table on disk
+ */
+static int
+query_index(const char *name, char **pixels, int count)
+{
+	FILE *file;
+	char magic[8], **files = NULL;
+	uint32_t version, num_files, num_pixels, num_entries;
+	uint32_t len, pixel, p, first, n, f, image, pixel_count, e;
+	uint32_t lo, hi, mid;
+	long table;
+	int q, status = 1;
+
+	file = fopen(name, "r");
+	if (!file) {
+		perror(name);
+		return 1;
+	}
+	if (fread(magic, 1, 8, file) != 8 || memcmp(magic, INDEX_MAGIC, 8) ||
+	    !get_uint32(file, &version) || version != INDEX_VERSION ||
+	    !get_uint32(file, &num_files) || !get_uint32(file, &num_pixels) ||
+	    !get_uint32(file, &num_entries))
+		goto bad;
+	files = calloc(num_files ? num_files : 1, sizeof (char *));
+	if (!files)
+		goto bad;
+	for (f = 0; f < num_files; f++) {
+		if (!get_uint32(file, &len) || len > 65536 ||
+		    !(files[f] = calloc(1, len + 1)) ||
+		    fread(files[f], 1, len, file) != len)
+			goto bad;
+	}
+	table = ftell(file);
+
+	for (q = 0; q < count; q++) {
+		if (sscanf(pixels[q], "%x", &pixel) != 1) {
+			fprintf (stderr, "%s: invalid pixel value\n", pixels[q]);
+			goto done;
+		}
+		lo = 0;
+		hi = num_pixels;
+		n = 0;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (fseek(file, table + mid * 12L, SEEK_SET) < 0 ||
+			    !get_uint32(file, &p) || !get_uint32(file, &first) ||
+			    !get_uint32(file, &n))
+				goto bad;
+			if (p == pixel)
+				break;
+			if (p < pixel)
+				lo = mid + 1;
+			else
+				hi = mid;
+			n = 0;
+		}
+		if (n && fseek(file, table + num_pixels * 12L + first * 12L,
+			       SEEK_SET) < 0)
+			goto bad;
+		for (e = 0; e < n; e++) {
+			if (!get_uint32(file, &f) || !get_uint32(file, &image) ||
+			    !get_uint32(file, &pixel_count) || f >= num_files)
+				goto bad;
+			printf ("%x: %s %u %u\n", pixel, files[f], image, pixel_count);
+		}
+	}
+	status = 0;
+	goto done;
+bad:
+	fprintf (stderr, "%s: invalid index\n", name);
+done:
+	for (f = 0; files && f < num_files; f++)
+		free (files[f]);
+	free (files);
+	fclose(file);
+	return status;
+}
+
+/*
+ * Print the pixel values drawn in 'rgb' in each of the named
+ * PNG files, using the color map chunk. Only the chunks
+ * ahead of the image data are read.
+ */
+static int
+lookup_pixel(uint32_t rgb, char **names, int count)
+{
+	png_struct *png;
+	png_info *info;
+	png_byte * volatile map;
+	size_t size;
+	FILE *file;
+	int status = 0, f, found;
+	size_t i;
+
+	for (f = 0; f < count; f++) {
+		file = fopen(names[f], "r");
+		if (!file) {
+			perror(names[f]);
+			status = 1;
+			continue;
+		}
+		map = NULL;
+		size = 0;
+		png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		info = png ? png_create_info_struct(png) : NULL;
+		if (!info || setjmp(png_jmpbuf(png))) {
+			fprintf (stderr, "%s: not a PNG file\n", names[f]);
+			png_destroy_read_struct (&png, &info, NULL);
+			free (map);
+			fclose(file);
+			status = 1;
+			continue;
+		}
+		png_init_io (png, file);
+		png_set_keep_unknown_chunks (png, PNG_HANDLE_CHUNK_ALWAYS,
+					     (png_const_bytep) COLOR_MAP_CHUNK, 1);
+		png_read_info (png, info);
+		get_color_map(png, info, (png_byte **) &map, &size);
+		png_destroy_read_struct (&png, &info, NULL);
+		fclose(file);
+
+		if (!map) {
+			fprintf (stderr, "%s: no color map\n", names[f]);
+			status = 1;
+			continue;
+		}
+		found = 0;
+		for (i = 0; i + COLOR_MAP_ENTRY <= size; i += COLOR_MAP_ENTRY) {
+			if (map[i + 4] == RGB_R(rgb) && map[i + 5] == RGB_G(rgb) &&
+			    map[i + 6] == RGB_B(rgb)) {
+				printf ("%s: %x\n", names[f], png_get_uint_32(map + i));
+				found++;
+			}
+		}
+		if (!found)
+			printf ("%s: no pixel drawn as %02x%02x%02x\n", names[f],
+				RGB_R(rgb), RGB_G(rgb), RGB_B(rgb));
+		free (map);
+	}
+	return status;
+}
+
+static const struct option options[] = {
+	{ .name = "diff", .has_arg = 0, .val = 'd' },
+	{ .name = "diff-image", .has_arg = 0, .val = 'D' },
+	{ .name = "archive", .has_arg = 0, .val = 'a' },
+	{ .name = "jobs", .has_arg = 1, .val = 'j' },
+	{ .name = "tiles", .has_arg = 2, .val = 't' },
+	{ .name = "pixel", .has_arg = 1, .val = 'p' },
+	{ .name = "index", .has_arg = 1, .val = 'i' },
+	{ .name = "query", .has_arg = 1, .val = 'q' },
+	{ .name = "stats", .has_arg = 0, .val = 's' },
+	{ .name = "help", .has_arg = 0, .val = 'h' },
+	{ 0, 0, 0, 0 },
+};
+
+static bool
+add_job(struct archive_job **jobs, int *count, char *name,
+	struct xts_image *image, uint64_t pixels)
+{
+	struct archive_job *new = realloc(*jobs, (*count + 1) * sizeof (**jobs));
+
+	if (!new)
+		return false;
+	new[*count].name = name;
+	new[*count].image = image;
+	new[*count].pixels = pixels;
+	(*count)++;
+	*jobs = new;
+	return true;
+}
+
+/* Check for a PNG signature, fetching the size from IHDR */
+static bool
+is_png(FILE *file, uint64_t *pixels)
+{
+	png_byte head[24];
+	bool png;
+
+	png = fread(head, 1, sizeof (head), file) == sizeof (head) &&
+		png_sig_cmp(head, 0, 8) == 0;
+	if (png)
+		*pixels = (uint64_t) png_get_uint_32(head + 16) *
+			png_get_uint_32(head + 20);
+	rewind(file);
+	return png;
+}
+
+static void
+usage(char *program, int status)
+{
+	fprintf(status ? stderr : stdout,
+		"usage: %s [--diff] [--diff-image] [--archive] [--jobs=<n>]\n"
+		"\t[--tiles[=<size>]] [--index=<file>] [--stats] [--help]\n"
+		"\txtest-image-file ...\n"
+		"       %s --pixel=<rrggbb> png-file ...\n"
+		"       %s --query=<index-file> pixel ...\n",
+		program, program, program);
+	exit(status);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct xts_image *image;
+	FILE        *input;
+	FILE        *output;
+	char        *inname;
+	int         f, i, c;
+	struct xts_image	*images = NULL, **last = &images;
+	struct xts_image	*bad;
+	bool        diff = false, diff_image = false, archival = false;
+	struct archive_job	*jobs = NULL;
+	int         num_jobs = 0;
+	int         workers = 0, num_images = 0, peak_jobs = 0;
+	uint64_t    pixels;
+	bool        stats = false;
+	int         tile_size = 0;
+	bool        lookup = false;
+	unsigned    rgb = 0;
+	char        *index_name = NULL, *query_name = NULL;
+	struct xts_index	index = { 0 };
+
+	/* Before opening anything else, so the descriptors
+	 * named in MAKEFLAGS can be checked
+	 */
+	jobserver_init();
+	resources_init();
+	workers = resources.cpus;
+
+	while ((c = getopt_long(argc, argv, "dDaj:t::p:i:q:sh", options, NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			diff = true;
+			break;
+		case 'D':
+			diff = diff_image = true;
+			break;
+		case 'a':
+			archival = true;
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			if (workers < 1)
+				usage(argv[0], 1);
+			break;
+		case 't':
+			tile_size = optarg ? atoi(optarg) : DEFAULT_TILE_SIZE;
+			if (tile_size < 1)
+				usage(argv[0], 1);
+			break;
+		case 'p':
+			if (sscanf(optarg, "%6x", &rgb) != 1)
+				usage(argv[0], 1);
+			lookup = true;
+			break;
+		case 'i':
+			index_name = optarg;
+			break;
+		case 'q':
+			query_name = optarg;
+			break;
+		case 's':
+			stats = true;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+			break;
+		default:
+			usage(argv[0], 1);
+			break;
+		}
+	}
+
+	/* Colors are given as rrggbb, matching the order in the map */
+	if (lookup)
+		return lookup_pixel(((rgb & 0xff) << 16) | (rgb & 0xff00) | (rgb >> 16),
+				    argv + optind, argc - optind);
+	if (query_name)
+		return query_index(query_name, argv + optind, argc - optind);
+
+	/* Read all of the images
+	 */
+	for (f = optind; f < argc; f++) {
+		inname = argv[f];
+		input = fopen(inname, "r");
+		if (!input) {
+			perror(inname);
+			continue;
+		}
+		if (archival && is_png(input, &pixels)) {
+			fclose(input);
+			if (!add_job(&jobs, &num_jobs, inname, NULL, pixels))
+				perror(inname);
+			continue;
+		}
+		if (index_name && !index_add_file(&index, inname))
+			index_name = NULL;
+		i = 0;
+		bad = NULL;
+		while ((image = read_image(input, inname)) != NULL) {
+			if (index_name && !index_add_image(&index, image, i)) {
+				fprintf (stderr, "%s: out of memory\n", index_name);
+				index_name = NULL;
+			}
+			image->dest_file = newname(inname, i, "png");
+			if (tile_size)
+				image->dzi_file = newname(inname, i, "dzi");
+			image->next = NULL;
+			*last = image;
+			last = &image->next;
+			num_images++;
+
+			/* XTS error files hold the bad image followed
+			 * by the expected one
+			 */
+			if (diff) {
+				if (bad) {
+					bad->good = image;
+					if (diff_image)
+						bad->diff_file = newname(inname, i - 1, "diff.png");
+					bad = NULL;
+				} else
+					bad = image;
+			}
+			i++;
+		}
+		fclose(input);
+	}
+
+	if (index_name && !write_index(&index, index_name))
+		perror(index_name);
+	free (index.files);
+	free (index.entries);
+
+	/* Assign colors for the whole set
+	 */
+	assign_rgb();
+
+	/* Archival encoding runs in parallel, so it needs all of
+	 * the images at once
+	 */
+	if (archival) {
+		for (image = images; image; image = image->next)
+			if (image->dest_file &&
+			    !add_job(&jobs, &num_jobs, image->dest_file, image,
+				     (uint64_t) image->width * image->height))
+				perror(image->dest_file);
+		workers = archive(jobs, num_jobs, workers, &peak_jobs);
+		free (jobs);
+	}
+
+	/* Write all of the images out using the
+	 * allocated colors
 	 */
 	while ((image = images) != NULL) {
-		if (image->dest_file) {
+		if (image->dest_file && !archival) {
 			printf ("%s\n", image->dest_file);
 			output = fopen(image->dest_file, "w");
 			if (!output)
@@ -417,7 +2734,27 @@ main (int argc, char **argv)
 				fclose(output);
 			}
 		}
+		if (image->dzi_file) {
+			printf ("%s\n", image->dzi_file);
+			dump_pyramid(image->dzi_file, image, tile_size);
+		}
+		if (image->good && image->dest_file && image->good->dest_file)
+			report_diff(image, image->good);
 		images = image->next;
 		free_image(image);
 	}
+
+	if (stats) {
+		fprintf(stderr, "images: %d\ncolors: %d\n", num_images, num_colors);
+		print_resources(archival ? workers : 0);
+		if (archival) {
+			fprintf(stderr, "jobserver: %s\n",
+				jobserver.active ? "active" :
+				jobserver.serial ? "unavailable" : "none");
+			fprintf(stderr, "most jobs at once: %d\n", peak_jobs);
+		}
+#ifdef COLOR_STATS
+		print_color_stats();
+#endif
+	}
 }